@@ -0,0 +1,51 @@
+#include "benchmark.h"
+
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+
+#include "talliers_network.h"
+#include "mpc_service.h"
+
+using utils::share;
+
+namespace {
+    template <typename Op>
+    cppcoro::task<double> measure(unsigned iterations, Op op) {
+        const auto start = std::chrono::steady_clock::now();
+        for (unsigned i = 0; i < iterations; i++)
+            (void) co_await op();
+        co_return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() / iterations;
+    }
+
+    void report(const link_profile &profile, const char *primitive, double ms) {
+        std::cout << std::left << std::setw(12) << profile.name << std::setw(16) << primitive
+                  << std::right << std::fixed << std::setprecision(3) << std::setw(12) << ms << " ms/op" << std::endl;
+    }
+}
+
+cppcoro::task<> run_benchmark(talliers_network &net, mpc_service &service,
+                              std::span<const link_profile> profiles, unsigned iterations) {
+    const unsigned bits_count = utils::ceil_log2(utils::p);
+    for (const auto &profile : profiles) {
+        net.emulate(profile);
+
+        const share x = co_await service.random_number(0);
+        const share y = co_await service.random_number(1);
+        auto a_i = co_await service.random_number_bits(0);
+        auto b_i = co_await service.random_number_bits(0);
+        const std::span<share> a{a_i.get(), bits_count}, b{b_i.get(), bits_count};
+
+        report(profile, "multiply", co_await measure(iterations, [&] { return service.multiply(0, x, y); }));
+        report(profile, "resolve", co_await measure(iterations, [&] { return service.resolve(0, x); }));
+        report(profile, "resolve_king", co_await measure(iterations, [&] { return service.resolve_king(0, x); }));
+        report(profile, "random_number", co_await measure(iterations, [&] { return service.random_number(0); }));
+        report(profile, "random_bit", co_await measure(iterations, [&] { return service.random_bit(0); }));
+        report(profile, "fan_in_or", co_await measure(iterations, [&] { return service.fan_in_or(0, a); }));
+        report(profile, "prefix_or", co_await measure(iterations, [&] { return service.prefix_or(0, a); }));
+        report(profile, "less_bitwise", co_await measure(iterations, [&] { return service.less_bitwise(0, a, b); }));
+        report(profile, "is_odd", co_await measure(iterations, [&] { return service.is_odd(0, x); }));
+        report(profile, "less", co_await measure(iterations, [&] { return service.less(0, x, y); }));
+    }
+    net.emulate(*link_profile::find("loopback"));
+}
@@ -0,0 +1,18 @@
+#ifndef VOTE_SECURE_BENCHMARK_H
+#define VOTE_SECURE_BENCHMARK_H
+
+#include <span>
+
+#include <cppcoro/task.hpp>
+
+#include "link_emulator.h"
+
+class talliers_network;
+class mpc_service;
+
+// Times every mpc_service primitive under each link profile. All talliers must run it
+// with the same arguments, as the primitives are executed in lockstep.
+cppcoro::task<> run_benchmark(talliers_network &net, mpc_service &service,
+                              std::span<const link_profile> profiles, unsigned iterations);
+
+#endif //VOTE_SECURE_BENCHMARK_H
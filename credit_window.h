@@ -0,0 +1,110 @@
+#ifndef VOTE_SECURE_CREDIT_WINDOW_H
+#define VOTE_SECURE_CREDIT_WINDOW_H
+
+#include <memory>
+#include <utility>
+
+#include <cppcoro/coroutine.hpp>
+
+// Bounds the number of operations in flight. Waiters are kept in several queues that
+// are served round robin as credits are returned, each queue in FIFO order, so a busy
+// queue can't starve the others. Only used from the io_service thread, so no locking.
+class credit_window {
+    struct waiter_node {
+        waiter_node *m_next = nullptr;
+        cppcoro::coroutine_handle<> m_awaiter;
+    };
+    struct waiters_queue {
+        waiter_node *m_head = nullptr;
+        waiter_node *m_tail = nullptr;
+    };
+public:
+    class credit {
+    public:
+        explicit credit(credit_window *window) noexcept : m_window(window) {}
+        credit(credit &&other) noexcept : m_window(std::exchange(other.m_window, nullptr)) {}
+        credit(const credit &) = delete;
+        credit &operator=(const credit &) = delete;
+        credit &operator=(credit &&) = delete;
+        ~credit() {
+            if (m_window)
+                m_window->release();
+        }
+    private:
+        credit_window *m_window;
+    };
+
+    explicit credit_window(unsigned credits = 0, unsigned queues = 1) :
+        m_credits(credits),
+        m_queues(new waiters_queue[queues]),
+        m_queues_count(queues)
+    { }
+
+    auto acquire(unsigned queue = 0) noexcept {
+        class awaiter : private waiter_node {
+        public:
+            awaiter(credit_window &window, unsigned queue) noexcept : m_window(window), m_queue(queue) {}
+
+            bool await_ready() const noexcept {
+                if (m_window.m_credits == 0)
+                    return false;
+                m_window.m_credits--;
+                return true;
+            }
+
+            void await_suspend(cppcoro::coroutine_handle<> awaiter) noexcept {
+                m_awaiter = awaiter;
+                auto &queue = m_window.m_queues[m_queue];
+                if (queue.m_tail)
+                    queue.m_tail->m_next = this;
+                else
+                    queue.m_head = this;
+                queue.m_tail = this;
+                m_window.m_waiting++;
+            }
+
+            credit await_resume() noexcept {
+                return credit{&m_window};
+            }
+        private:
+            credit_window &m_window;
+            unsigned m_queue;
+        };
+        return awaiter{ *this, queue % m_queues_count };
+    }
+
+    [[nodiscard]] unsigned available() const noexcept {
+        return m_credits;
+    }
+
+    [[nodiscard]] bool has_waiters() const noexcept {
+        return m_waiting != 0;
+    }
+private:
+    void release() noexcept {
+        if (m_waiting == 0) {
+            m_credits++;
+            return;
+        }
+        // hand the credit straight to the oldest waiter of the next non empty queue
+        while (m_queues[m_next_queue].m_head == nullptr)
+            m_next_queue = (m_next_queue + 1) % m_queues_count;
+        auto &queue = m_queues[m_next_queue];
+        m_next_queue = (m_next_queue + 1) % m_queues_count;
+
+        waiter_node *waiter = queue.m_head;
+        queue.m_head = waiter->m_next;
+        if (queue.m_head == nullptr)
+            queue.m_tail = nullptr;
+        m_waiting--;
+        waiter->m_awaiter.resume();
+    }
+
+    unsigned m_credits;
+    std::unique_ptr<waiters_queue[]> m_queues;
+    unsigned m_queues_count;
+    unsigned m_next_queue = 0;
+    unsigned m_waiting = 0;
+};
+
+#endif //VOTE_SECURE_CREDIT_WINDOW_H
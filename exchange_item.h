@@ -6,6 +6,7 @@
 #define VOTE_SECURE_EXCHANGE_ITEM_H
 
 #include <atomic>
+#include <bit>
 #include <cassert>
 #include <iostream>
 
@@ -14,25 +15,57 @@
 #include "utils.h"
 #include "mpc_service.h"
 
-class exchange_item {
+// Sized to the committee and aligned so the receive path touches a single cache line
+// per item while D is small.
+class alignas(64) exchange_item {
 public:
     exchange_item() noexcept {
-        val[0].m_mask = (1U << mpc_service::D) - 1U;
-        val[1].m_mask = (1U << mpc_service::D) - 1U;
+        val[0].m_mask = m_expected;
+        val[1].m_mask = m_expected;
     }
 
     [[nodiscard]] bool is_set() const noexcept {
         return m_state.load(std::memory_order_acquire) == static_cast<const void*>(this);
     }
 
+    // complete the current round once count shares arrived, instead of waiting for all of them
+    void expect(unsigned count) noexcept {
+        m_needed = utils::narrow_cast<uint8_t>(count);
+    }
+
+    // restrict every round to the talliers in mask, only before the item is first used
+    void expect_from(uint32_t mask) noexcept {
+        m_expected = utils::narrow_cast<uint16_t>(mask);
+        val[0].m_mask = mask;
+        val[1].m_mask = mask;
+    }
+
+    // talliers whose share for the current round has arrived
+    [[nodiscard]] uint32_t received() const noexcept {
+        return ~val[0].m_mask & m_expected;
+    }
+
     void set(utils::share share, unsigned index) {
-        for (auto &level : val) {
+        if (m_late.load(std::memory_order_relaxed) & (1U << index)) {
+            // belongs to a round that already completed without it, the last one frees the item
+            if (m_late.fetch_and(~(1U << index), std::memory_order_acq_rel) == (1U << index)) {
+                void *waiter = m_state.load(std::memory_order_acquire);
+                if (waiter != nullptr && waiter != static_cast<void *>(this) &&
+                    m_state.compare_exchange_strong(waiter, nullptr, std::memory_order_acq_rel)) {
+                    cppcoro::coroutine_handle<>::from_address(waiter).resume();
+                }
+            }
+            return;
+        }
+        for (unsigned l = 0; l < 2; l++) {
+            auto &level = val[l];
             if (level.m_mask & (1U << index)) {
                 level.m_values[index] = share;
-                if ((level.m_mask ^= (1U << index)) == 0) {
+                const uint32_t mask = (level.m_mask ^= (1U << index));
+                if (l == 0 && (mask == 0 || (unsigned)std::popcount(~mask & m_expected) >= m_needed)) {
                     void *const setState = static_cast<void *>(this);
                     void *oldState = m_state.exchange(setState, std::memory_order_acq_rel);
-                    if (oldState != setState) {
+                    if (oldState != setState && oldState != nullptr) {
                         cppcoro::coroutine_handle<>::from_address(oldState).resume();
                     }
                 }
@@ -72,25 +105,72 @@ public:
         co_await *this;
     }
 
-    std::unique_ptr<utils::share[]> result() {
-        std::unique_ptr<utils::share[]> res(new utils::share[mpc_service::D]);
+    // A round may complete before every share came in, but the next one on the item only starts
+    // once the late shares did. No tallier then gets more than a round ahead of another, which is
+    // all the two levels can hold.
+    auto drained() noexcept {
+        class awaiter {
+        public:
+            explicit awaiter(exchange_item& item) noexcept : m_item(item) {}
+
+            bool await_ready() const noexcept {
+                return m_item.m_late.load(std::memory_order_acquire) == 0;
+            }
+
+            bool await_suspend(cppcoro::coroutine_handle<> awaiter) {
+                // nothing completes the next round before this tallier's own share, so m_state is free
+                void* oldState = nullptr;
+                if (!m_item.m_state.compare_exchange_strong(oldState, awaiter.address(),
+                                                            std::memory_order_release, std::memory_order_acquire)) {
+                    assert(false);
+                    return false;
+                }
+                if (m_item.m_late.load(std::memory_order_acquire) != 0)
+                    return true;
+                // the last late share came in meanwhile
+                oldState = awaiter.address();
+                return !m_item.m_state.compare_exchange_strong(oldState, nullptr, std::memory_order_acq_rel);
+            }
+            void await_resume() noexcept {}
+        private:
+            exchange_item& m_item;
+        };
+        return awaiter{ *this };
+    }
+
+    utils::share_vector result() {
+        utils::share_vector res(mpc_service::D);
         for (int i = 0; i < mpc_service::D; i++) {
             res[i] = val[0].m_values[i];
             val[0].m_values[i] = val[1].m_values[i];
         }
+        // shares still missing from an early completed round must not leak into the next one;
+        // per-peer FIFO delivery brings them in before any of that peer's later shares
+        assert((m_late.load(std::memory_order_relaxed) & val[0].m_mask) == 0);
+        m_late.fetch_or(val[0].m_mask, std::memory_order_relaxed);
         val[0].m_mask = (uint32_t)val[1].m_mask;
-        val[1].m_mask = ((1U << mpc_service::D) - 1U);
+        val[1].m_mask = m_expected;
+        m_needed = mpc_service::D;
 
         void* oldState = static_cast<void*>(this);
         m_state.compare_exchange_strong(oldState, nullptr, std::memory_order_relaxed);
         return res;
     }
 private:
+    static_assert(mpc_service::D <= 16, "the expected talliers are kept in a 16 bit mask");
+
     std::atomic<void*> m_state = nullptr;
+    std::atomic<uint32_t> m_late = 0;
+    // packed next to each other into the word m_needed had alone, so the item stays a single
+    // cache line up to D = 5
+    uint16_t m_expected = (1U << mpc_service::D) - 1U;
+    uint8_t m_needed = mpc_service::D;
     struct {
         std::atomic<uint32_t> m_mask;
-        utils::share m_values[13];
+        utils::share m_values[mpc_service::D];
     } val[2];
 };
 
+static_assert(mpc_service::D > 5 || sizeof(exchange_item) == 64, "exchange_item should fit a cache line");
+
 #endif //VOTE_SECURE_EXCHANGE_ITEM_H
@@ -0,0 +1,119 @@
+#ifndef VOTE_SECURE_FRAME_POOL_H
+#define VOTE_SECURE_FRAME_POOL_H
+
+#include <atomic>
+#include <cstddef>
+#include <new>
+
+#include <cppcoro/coroutine.hpp>
+#include <cppcoro/task.hpp>
+
+class mpc_service;
+class talliers_network;
+
+// Per-thread, size-class free lists for coroutine frames. Frames are never returned
+// to the heap while the thread lives, so steady state does no heap allocation.
+class frame_pool {
+public:
+    static void *allocate(std::size_t size) {
+        live_frames.fetch_add(1, std::memory_order_relaxed);
+        const std::size_t cls = size_class(size);
+        if (cls >= classes_count)
+            return ::operator new(size);
+
+        auto &head = lists().heads[cls];
+        if (head != nullptr) {
+            node *res = head;
+            head = res->next;
+            return res;
+        }
+        reserved_bytes.fetch_add((cls + 1) * granularity, std::memory_order_relaxed);
+        return ::operator new((cls + 1) * granularity);
+    }
+
+    static void deallocate(void *ptr, std::size_t size) noexcept {
+        live_frames.fetch_sub(1, std::memory_order_relaxed);
+        const std::size_t cls = size_class(size);
+        if (cls >= classes_count) {
+            ::operator delete(ptr);
+            return;
+        }
+        auto &head = lists().heads[cls];
+        head = new (ptr) node{head};
+    }
+
+    // coroutine frames currently alive
+    static std::size_t live() noexcept {
+        return live_frames.load(std::memory_order_relaxed);
+    }
+
+    // bytes taken from the heap for pooled frames, by all threads
+    static std::size_t reserved() noexcept {
+        return reserved_bytes.load(std::memory_order_relaxed);
+    }
+private:
+    struct node {
+        node *next;
+    };
+    static constexpr std::size_t granularity = 64;
+    static constexpr std::size_t classes_count = 64;
+
+    static constexpr std::size_t size_class(std::size_t size) noexcept {
+        return (size - 1) / granularity;
+    }
+
+    struct free_lists {
+        node *heads[classes_count] = {};
+
+        ~free_lists() {
+            for (auto head : heads) {
+                while (head != nullptr) {
+                    node *next = head->next;
+                    ::operator delete(head);
+                    head = next;
+                }
+            }
+        }
+    };
+
+    static free_lists &lists() noexcept {
+        static thread_local free_lists instance;
+        return instance;
+    }
+
+    static inline std::atomic<std::size_t> live_frames = 0;
+    static inline std::atomic<std::size_t> reserved_bytes = 0;
+};
+
+template <typename T>
+class pooled_task_promise : public cppcoro::detail::task_promise<T> {
+public:
+    static void *operator new(std::size_t size) {
+        return frame_pool::allocate(size);
+    }
+
+    static void operator delete(void *ptr, std::size_t size) noexcept {
+        frame_pool::deallocate(ptr, size);
+    }
+};
+static_assert(sizeof(pooled_task_promise<int>) == sizeof(cppcoro::detail::task_promise<int>),
+              "pooled promise must be layout compatible with the task promise");
+
+// Route every task returning member coroutine of the services through the pool.
+#ifdef CPPCORO_COROHEADER_FOUND_AND_USABLE
+namespace std {
+#else
+namespace std::experimental {
+#endif
+    template <typename T, typename... Args>
+    struct coroutine_traits<cppcoro::task<T>, mpc_service &, Args...> {
+        using promise_type = pooled_task_promise<T>;
+    };
+
+    template <typename T, typename... Args>
+    struct coroutine_traits<cppcoro::task<T>, talliers_network &, Args...> {
+        using promise_type = pooled_task_promise<T>;
+    };
+}
+
+#endif //VOTE_SECURE_FRAME_POOL_H
@@ -0,0 +1,67 @@
+#include "link_emulator.h"
+
+#include <algorithm>
+
+using namespace std::chrono_literals;
+
+static constexpr link_profile profiles[] = {
+        {"loopback", 0us, 0us, 0, false},
+        {"lan", 250us, 50us, 125'000'000, false},
+        {"metro", 5ms, 1ms, 125'000'000, false},
+        {"wan", 30ms, 5ms, 12'500'000, false},
+        {"wan-reorder", 30ms, 10ms, 12'500'000, true},
+};
+
+std::span<const link_profile> link_profile::presets() {
+    return profiles;
+}
+
+const link_profile *link_profile::find(std::string_view name) {
+    auto it = std::find_if(std::begin(profiles), std::end(profiles), [name](const link_profile &profile) {
+        return profile.name == name;
+    });
+    return it == std::end(profiles) ? nullptr : it;
+}
+
+link_emulator::link_emulator(cppcoro::io_service &ioSvc, unsigned peers) :
+        ioSvc(ioSvc),
+        m_links(new link[peers]),
+        m_peers(peers),
+        m_random(std::random_device{}())
+{ }
+
+void link_emulator::set_profile(const link_profile &profile) {
+    for (unsigned i = 0; i < m_peers; i++)
+        set_profile(i, profile);
+}
+
+void link_emulator::set_profile(unsigned peer, const link_profile &profile) {
+    m_links[peer] = link{profile};
+    m_enabled = std::any_of(m_links.get(), m_links.get() + m_peers, [](const link &l) {
+        return l.profile.latency != 0us || l.profile.jitter != 0us || l.profile.bandwidth != 0;
+    });
+}
+
+cppcoro::task<> link_emulator::transmit(unsigned peer, size_t bytes) {
+    auto &l = m_links[peer];
+    const auto now = clock::now();
+
+    // frames leave one after the other at the link's bandwidth
+    auto departure = std::max(now, l.busy_until);
+    if (l.profile.bandwidth != 0)
+        departure += std::chrono::nanoseconds(bytes * 1'000'000'000ULL / l.profile.bandwidth);
+    l.busy_until = departure;
+
+    auto arrival = departure + l.profile.latency;
+    if (l.profile.jitter != 0us) {
+        std::uniform_int_distribution<int64_t> jitter(-l.profile.jitter.count(), l.profile.jitter.count());
+        arrival = std::max(departure, arrival + std::chrono::microseconds(jitter(m_random)));
+    }
+    // a stream link never delivers a frame before the one sent ahead of it
+    if (!l.profile.reorder)
+        arrival = std::max(arrival, l.last_arrival);
+    l.last_arrival = std::max(arrival, l.last_arrival);
+
+    if (arrival > now)
+        co_await ioSvc.schedule_after(arrival - now);
+}
@@ -0,0 +1,54 @@
+#ifndef VOTE_SECURE_LINK_EMULATOR_H
+#define VOTE_SECURE_LINK_EMULATOR_H
+
+#include <chrono>
+#include <memory>
+#include <random>
+#include <span>
+#include <string_view>
+
+#include <cppcoro/io_service.hpp>
+#include <cppcoro/task.hpp>
+
+struct link_profile {
+    std::string_view name;
+    std::chrono::microseconds latency;   // one way
+    std::chrono::microseconds jitter;    // uniform in [-jitter, jitter]
+    uint64_t bandwidth;                  // bytes per second, 0 for unlimited
+    bool reorder;                        // whether frames may overtake each other
+
+    static std::span<const link_profile> presets();
+    static const link_profile *find(std::string_view name);
+};
+
+// Delays outgoing frames as if they crossed a slower link, so round-heavy protocols
+// can be measured on loopback. Only used from the io_service thread.
+class link_emulator {
+public:
+    link_emulator(cppcoro::io_service &ioSvc, unsigned peers);
+
+    void set_profile(const link_profile &profile);
+    void set_profile(unsigned peer, const link_profile &profile);
+    [[nodiscard]] bool enabled() const noexcept {
+        return m_enabled;
+    }
+
+    // suspends until a frame of the given size, sent now, would have reached the peer
+    cppcoro::task<> transmit(unsigned peer, size_t bytes);
+private:
+    using clock = std::chrono::steady_clock;
+
+    struct link {
+        link_profile profile{};
+        clock::time_point busy_until{};
+        clock::time_point last_arrival{};
+    };
+
+    cppcoro::io_service &ioSvc;
+    std::unique_ptr<link[]> m_links;
+    unsigned m_peers;
+    bool m_enabled = false;
+    std::default_random_engine m_random;
+};
+
+#endif //VOTE_SECURE_LINK_EMULATOR_H
@@ -9,9 +9,13 @@
 
 #include <memory>
 #include <iostream>
+#include <string_view>
 
 #include "talliers_network.h"
 #include "mpc_service.h"
+#include "benchmark.h"
+#include "preprocessing_store.h"
+#include "sharded_tally.h"
 
 #include "utils.h"
 
@@ -19,8 +23,40 @@ int main(int argc, const char *argv[]) {
     std::cout << std::unitbuf; // Always flush when writing
     std::cerr << std::unitbuf; // Always flush when writing
 
+    // vote_secure <tallier id> [--bench [profile|all] [iterations]]
+    //                          [--preprocess <file> [bits] [numbers]]
+    //                          [--preprocessed <file>]
+    //                          [--shard <committee> <committees> [ballots]]
+    //                          [--king]
+    const int8_t tallier_id = argc < 2 ? 0 : atoi(argv[1]);
+    const std::string_view mode = argc >= 3 ? argv[2] : "";
+    if (mode == "--shard" && argc < 5) {
+        std::cerr << "--shard needs the committee and the number of shard committees" << std::endl;
+        return 1;
+    }
+    const uint8_t committee = mode == "--shard" ? atoi(argv[3]) : 0;
+    if ((mode == "--preprocess" || mode == "--preprocessed") && argc < 4) {
+        std::cerr << mode << " needs a file" << std::endl;
+        return 1;
+    }
+    std::unique_ptr<preprocessing_store> store;
+    if (mode == "--preprocessed")
+        store = std::make_unique<preprocessing_store>(argv[3], tallier_id);
+
+    const bool bench = mode == "--bench";
+    std::span<const link_profile> bench_profiles = link_profile::presets();
+    if (bench && argc >= 4 && std::string_view(argv[3]) != "all") {
+        const auto *profile = link_profile::find(argv[3]);
+        if (profile == nullptr) {
+            std::cerr << "unknown link profile " << argv[3] << std::endl;
+            return 1;
+        }
+        bench_profiles = {profile, 1};
+    }
+    const unsigned bench_iterations = bench && argc >= 5 ? atoi(argv[4]) : 10;
+
     cppcoro::io_service ioSvc(16384);
-    talliers_network net(ioSvc, argc < 2 ? 0 : atoi(argv[1]));
+    talliers_network net(ioSvc, tallier_id, talliers_network::default_max_in_flight, committee);
 
     (void) cppcoro::sync_wait(cppcoro::when_all(
             [&]() -> cppcoro::task<> {
@@ -31,17 +67,13 @@ int main(int argc, const char *argv[]) {
                 mpc_service service(net);
 
                 auto super_task = [&](uint16_t msg_id) -> cppcoro::task<> {
-                    std::vector<cppcoro::task<utils::share>> rnd_t;
-                    rnd_t.reserve(32);
-                    for (int i = 0; i < 32; i++)
-                        rnd_t.push_back(service.random_bit(msg_id + i));
-                    auto rnd = co_await cppcoro::when_all(std::move(rnd_t));
+                    auto rnd = co_await service.random_bits(msg_id, 32);
 
                     std::vector<cppcoro::task<utils::share>> tasks;
                     tasks.reserve(33);
                     for (int i = 0; i < 32; i++)
                         tasks.push_back(service.resolve(msg_id + i, rnd[i]));
-                    tasks.push_back(service.fan_in_or(msg_id + 32, {rnd.data(), 32}));
+                    tasks.push_back(service.fan_in_or(msg_id + 32, {rnd.get(), 32}));
                     auto res = co_await cppcoro::when_all(std::move(tasks));
 
                     std::string out = "{";
@@ -64,15 +96,33 @@ int main(int argc, const char *argv[]) {
                     std::cout << co_await service.resolve(i, co_await service.random_bit(i)) << std::endl;
                 };
 
-                for (int j = 0; j < 10; j++) {
-                    std::vector<cppcoro::task<>> tasks;
-                    tasks.reserve(100);
-                    for (unsigned i = 0; i < 50; i++)
-                        tasks.push_back(super_task(80 * i));
-                    co_await cppcoro::when_all(std::move(tasks));
+                if (store) {
+                    co_await align_preprocessed(net, *store);
+                    service.use_preprocessed(*store);
+                }
+                if (mode == "--king")
+                    service.use_king_reveal(true);
+
+                if (bench) {
+                    co_await run_benchmark(net, service, bench_profiles, bench_iterations);
+                } else if (mode == "--shard") {
+                    co_await run_sharded_tally(net, service, committee, atoi(argv[4]), argc >= 6 ? atoi(argv[5]) : 1000);
+                } else if (mode == "--preprocess") {
+                    co_await preprocess(service, argv[3], tallier_id,
+                                        argc >= 5 ? strtoull(argv[4], nullptr, 10) : 65536,
+                                        argc >= 6 ? strtoull(argv[5], nullptr, 10) : 1024);
+                } else {
+                    for (int j = 0; j < 10; j++) {
+                        std::vector<cppcoro::task<>> tasks;
+                        tasks.reserve(100);
+                        for (unsigned i = 0; i < 50; i++)
+                            tasks.push_back(super_task(80 * i));
+                        co_await cppcoro::when_all(std::move(tasks));
+                    }
                 }
 
-                std::cout << "Done!" << std::endl;
+                std::cout << "Done! (" << frame_pool::live() << " live frames, "
+                          << frame_pool::reserved() << " bytes pooled)" << std::endl;
                 co_await ioSvc.schedule_after(std::chrono::seconds(1));
                 co_await net.close();
             }(),
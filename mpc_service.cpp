@@ -5,6 +5,7 @@
 
 #include "endian_number.h"
 #include "talliers_network.h"
+#include "preprocessing_store.h"
 
 #include <span>
 
@@ -29,16 +30,32 @@ namespace calc {
     }
 }
 
-mpc_service::mpc_service(talliers_network &network) :
+mpc_service::mpc_service(talliers_network &network, uint8_t session) :
     network(network),
+    session(session),
     vandermond_mat_inv_row(utils::vandermond_mat_inv_row(D)),
+    unpack_mat(utils::packed_unpack_matrix(D, max_packing)),
     p_bits_size(utils::ceil_log2(utils::p)),
     block_size(utils::block_size(utils::p))
 { }
 
 cppcoro::task<utils::share> mpc_service::multiply(uint16_t msg_id, share a, share b) {
-    auto h_i = utils::gen_shamir(utils::narrow_cast<share>(((uint64_t)a * b) % p), D, t);
-    auto results = co_await network.exchange(msg_id, {h_i.get(), D});
+    return this->reduce_degree(msg_id, utils::narrow_cast<share>(((uint64_t)a * b) % p));
+}
+
+cppcoro::task<share> mpc_service::dot_product(uint16_t msg_id, std::span<const share> a, std::span<const share> b) {
+    assert(a.size() == b.size());
+    // the local products all lie on degree 2(t - 1) polynomials, so their sum needs one reduction
+    uint64_t sum = 0;
+    for (unsigned i = 0; i < a.size(); i++)
+        sum = (sum + ((uint64_t)a[i] * b[i]) % p) % p;
+    return this->reduce_degree(msg_id, utils::narrow_cast<share>(sum));
+}
+
+// product is a point on a degree 2(t - 1) polynomial, reshare it back to degree t - 1
+cppcoro::task<share> mpc_service::reduce_degree(uint16_t msg_id, share product) {
+    auto h_i = utils::gen_shamir(product, D, t);
+    auto results = co_await network.exchange(session, msg_id, h_i);
 
     uint64_t sum = 0;
     for (unsigned i = 0; i < D; i++) {
@@ -48,21 +65,37 @@ cppcoro::task<utils::share> mpc_service::multiply(uint16_t msg_id, share a, shar
 }
 
 cppcoro::task<share> mpc_service::resolve(uint16_t msg_id, share part) {
-    std::unique_ptr<share[]> shares(new share[D]);
+    if (king_reveal)
+        co_return co_await resolve_king(msg_id, part);
+    utils::share_vector shares(D);
     for (unsigned i = 0; i < D; i++)
         shares[i] = part;
-    auto answers = co_await network.exchange(msg_id, {shares.get(), D});
-    co_return utils::resolve_shamir({answers.get(), D});
+    // the value is on a degree t - 1 polynomial, so the first t shares settle it
+    uint32_t received;
+    auto answers = co_await network.exchange(session, msg_id, shares, t, &received);
+    co_return utils::resolve_shamir(answers, received);
+}
+
+cppcoro::task<share> mpc_service::resolve_king(uint16_t msg_id, share part) {
+    uint32_t received;
+    auto answers = co_await network.to_king(session, msg_id, part, t, &received);
+    if (!network.is_king(msg_id))
+        co_return answers[talliers_network::king(msg_id)];
+    const share value = utils::resolve_shamir(answers, received);
+    co_await network.king_reply(session, msg_id, value);
+    co_return value;
 }
 
 cppcoro::task<share> mpc_service::random_number(uint16_t msg_id) {
     auto r_i = utils::gen_shamir(utils::random_value(), D, t);
-    auto all_rnd = co_await network.exchange(msg_id, {r_i.get(), D});
-    co_return calc::sum({all_rnd.get(), D});
+    auto all_rnd = co_await network.exchange(session, msg_id, r_i);
+    co_return calc::sum(all_rnd);
 }
 
 cppcoro::task<share> mpc_service::random_bit(uint16_t msg_id) {
     static uint64_t inverse_2 = utils::mod_inverse(2);
+    if (preprocessed && preprocessed->bits_left() > 0)
+        co_return preprocessed->take_bits(1)[0];
     for (;;) {
         auto r = co_await this->random_number(msg_id);
         auto r2 = co_await this->resolve(msg_id, co_await this->multiply(msg_id, r, r));
@@ -73,6 +106,64 @@ cppcoro::task<share> mpc_service::random_bit(uint16_t msg_id) {
     }
 }
 
+cppcoro::task<std::unique_ptr<share[]>> mpc_service::random_bits(uint16_t msg_id, unsigned count) {
+    static uint64_t inverse_2 = utils::mod_inverse(2);
+    std::unique_ptr<share[]> bits(new share[count]);
+    unsigned stored = 0;
+    if (preprocessed) {
+        // the store hands out views into the mapping; the copy is kept because a short store is
+        // topped up by the online path in the same owned array
+        auto taken = preprocessed->take_bits(count);
+        std::copy(taken.begin(), taken.end(), bits.get());
+        stored = taken.size();
+    }
+    std::vector<unsigned> pending;
+    pending.reserve(count - stored);
+    for (unsigned i = stored; i < count; i++)
+        pending.push_back(i);
+
+    while (!pending.empty()) {
+        // every pending slot runs the same steps in the same rounds, on msg_id + slot
+        std::vector<cppcoro::task<share>> r_tasks;
+        r_tasks.reserve(pending.size());
+        for (unsigned slot : pending)
+            r_tasks.push_back(this->random_number(msg_id + slot));
+        auto r = co_await cppcoro::when_all(std::move(r_tasks));
+
+        std::vector<cppcoro::task<share>> r2_tasks;
+        r2_tasks.reserve(pending.size());
+        for (unsigned i = 0; i < pending.size(); i++)
+            r2_tasks.push_back(this->multiply(msg_id + pending[i], r[i], r[i]));
+        auto r2_shares = co_await cppcoro::when_all(std::move(r2_tasks));
+
+        std::vector<cppcoro::task<share>> open_tasks;
+        open_tasks.reserve(pending.size());
+        for (unsigned i = 0; i < pending.size(); i++)
+            open_tasks.push_back(this->resolve(msg_id + pending[i], r2_shares[i]));
+        auto r2 = co_await cppcoro::when_all(std::move(open_tasks));
+
+        // invert all the roots at once, and retry only the slots whose square was 0
+        std::vector<unsigned> failed;
+        std::vector<unsigned> done;
+        std::vector<share> roots;
+        for (unsigned i = 0; i < pending.size(); i++) {
+            if (r2[i] == 0) {
+                failed.push_back(pending[i]);
+            } else {
+                done.push_back(i);
+                roots.push_back(utils::modular_sqrt(r2[i]));
+            }
+        }
+        utils::batch_mod_inverse(roots);
+        for (unsigned k = 0; k < done.size(); k++) {
+            const unsigned i = done[k];
+            bits[pending[i]] = utils::narrow_cast<share>(((((uint64_t)roots[k] * r[i] + 1) % p) * inverse_2) % p);
+        }
+        pending = std::move(failed);
+    }
+    co_return bits;
+}
+
 cppcoro::task<share> mpc_service::fan_in_or(uint16_t msg_id, const std::span<utils::share> bits) {
     const share A = calc::sum(bits, 1);
     const auto alpha_i = utils::lagrange_polynomial_fan(bits.size());
@@ -109,27 +200,26 @@ cppcoro::task<std::unique_ptr<share[]>> mpc_service::prefix_or(uint16_t msg_id,
     for (unsigned i = 1; i < y_i.size(); i++)
         f_i[i] = y_i[i] - y_i[i - 1];
 
-    // calc g
-    std::vector<cppcoro::task<share>> g_ij_tasks;
-    g_ij_tasks.reserve(a_i.size());
+    // calc c, every c_j is the inner product of f with column j of a (the g_ij are never needed alone)
+    std::unique_ptr<share[]> a_ji(new share[lam * lam]);
+    std::unique_ptr<unsigned[]> rows(new unsigned[lam]);
+    for (unsigned j = 0; j < lam; j++)
+        rows[j] = 0;
     for (unsigned i = 0, ij = 0; i < lam; i++)
         for (unsigned j = 0; j < lam && ij < a_i.size(); j++, ij++)
-            g_ij_tasks.push_back(this->multiply(msg_id + ij, f_i[i], a_i[ij]));
-    auto g_ij = co_await cppcoro::when_all(std::move(g_ij_tasks));
+            a_ji[j * lam + rows[j]++] = a_i[ij];
 
-    // calc c
-    std::unique_ptr<share[]> c_j(new share[lam]);
+    std::vector<cppcoro::task<share>> c_j_tasks;
+    c_j_tasks.reserve(lam);
     for (unsigned j = 0; j < lam; j++)
-        c_j[j] = 0;
-    for (unsigned ij = 0; ij < g_ij.size(); )
-        for (unsigned j = 0; j < lam && ij < g_ij.size(); j++, ij++)
-            c_j[j] = (c_j[j] + (uint64_t)g_ij[ij]) % p;
+        c_j_tasks.push_back(this->dot_product(msg_id + j, {f_i.get(), rows[j]}, {a_ji.get() + j * lam, rows[j]}));
+    auto c_j = co_await cppcoro::when_all(std::move(c_j_tasks));
 
     // calc h
     std::vector<cppcoro::task<share>> h_j_tasks;
     h_j_tasks.reserve(lam);
     for (unsigned j = 1, msg = msg_id; j <= lam; j++, msg += 2 * lam)
-        h_j_tasks.push_back(this->fan_in_or(msg, {c_j.get(), j}));
+        h_j_tasks.push_back(this->fan_in_or(msg, {c_j.data(), j}));
     auto h_j = co_await cppcoro::when_all(std::move(h_j_tasks));
 
     // calc s
@@ -167,32 +257,29 @@ cppcoro::task<share> mpc_service::less_bitwise(uint16_t msg_id, const std::span<
     for (unsigned i = 0; i < a_i.size() - 1; i++)
         d_i[i] = utils::narrow_cast<share>(((uint64_t)p + d_i[i] - d_i[i + 1]) % p);
 
-    // calc h
-    std::vector<cppcoro::task<share>> h_i_tasks;
-    h_i_tasks.reserve(a_i.size());
-    for (unsigned i = 0; i < a_i.size(); i++)
-        h_i_tasks.push_back(this->multiply(msg_id + i, d_i[i], b_i[i]));
-    auto h_i = co_await cppcoro::when_all(std::move(h_i_tasks));
-
-    co_return calc::sum(h_i);
+    // calc h, only its sum is used
+    co_return co_await this->dot_product(msg_id, {d_i.get(), a_i.size()}, b_i);
 }
 
 cppcoro::task<std::unique_ptr<share[]>> mpc_service::random_number_bits(uint16_t msg_id) {
-    for (;;) {
-        std::vector<cppcoro::task<share>> r_i_tasks;
-        r_i_tasks.reserve(p_bits_size);
-        for (unsigned i = 0; i < p_bits_size; i++)
-            r_i_tasks.push_back(this->random_bit(msg_id + i));
-        auto r_i = co_await cppcoro::when_all(std::move(r_i_tasks));
-
-        auto p_i = calc::to_bits(p, p_bits_size);
-        auto check_bit = co_await this->resolve(msg_id, co_await this->less_bitwise(msg_id, r_i, {p_i.get(), p_bits_size}));
-        if (check_bit == 1) {
+    if (preprocessed) {
+        auto number = preprocessed->take_number_bits();
+        if (!number.empty()) {
+            // a view would tie the caller to the store's lifetime and to another return type than the
+            // online path; copying p_bits_size shares is noise next to the rounds it replaces
             std::unique_ptr<share[]> res(new share[p_bits_size]);
-            std::copy(r_i.begin(), r_i.end(), res.get());
+            std::copy(number.begin(), number.end(), res.get());
             co_return res;
         }
     }
+    for (;;) {
+        auto r_i = co_await this->random_bits(msg_id, p_bits_size);
+
+        auto p_i = calc::to_bits(p, p_bits_size);
+        auto check_bit = co_await this->resolve(msg_id, co_await this->less_bitwise(msg_id, {r_i.get(), p_bits_size}, {p_i.get(), p_bits_size}));
+        if (check_bit == 1)
+            co_return r_i;
+    }
 }
 
 cppcoro::task<share> mpc_service::is_odd(uint16_t msg_id, share x) {
@@ -222,4 +309,79 @@ cppcoro::task<share> mpc_service::less(uint16_t msg_id, share a, share b) {
     auto d = utils::narrow_cast<share>(((uint64_t)p + x + y - c) % p);
     auto e = co_await this->multiply(msg_id, w, utils::narrow_cast<share>(((uint64_t)p + d - c) % p));
     co_return utils::narrow_cast<share>(((uint64_t)p + 1 + e - d) % p);
+}
+
+cppcoro::task<utils::share_vector> mpc_service::unpack(uint16_t msg_id, share packed, unsigned count) {
+    assert(count <= max_packing);
+    // reshare the packed share, then evaluate the packed polynomial at every secret point over the reshares
+    auto s_i = utils::gen_shamir(packed, D, t);
+    auto all_s = co_await network.exchange(session, msg_id, s_i);
+
+    utils::share_vector res(count);
+    for (unsigned i = 0; i < count; i++) {
+        uint64_t sum = 0;
+        for (unsigned j = 0; j < D; j++)
+            sum += ((uint64_t)all_s[j] * unpack_mat[i * D + j]) % p;
+        res[i] = utils::narrow_cast<share>(sum % p);
+    }
+    co_return res;
+}
+
+cppcoro::task<share> mpc_service::ballots_constraint(uint16_t msg_id, std::span<share> ballots, unsigned candidates) {
+    // a public random seed, opened only now that the ballots are fixed
+    share seed;
+    do {
+        seed = co_await this->resolve(msg_id, co_await this->random_number(msg_id));
+    } while (seed == 0);
+
+    // sum of seed^k * c_k over every constraint c_k: x * (x - 1) for each entry, and the entries sum minus 1
+    uint64_t z = 0, coeff = 1;
+    for (unsigned b = 0; b < ballots.size(); b += candidates) {
+        uint64_t entries = 0;
+        for (unsigned j = 0; j < candidates; j++) {
+            const uint64_t x = ballots[b + j];
+            coeff = (coeff * seed) % p;
+            z = (z + coeff * ((x * (p + x - 1)) % p)) % p;
+            entries += x;
+        }
+        coeff = (coeff * seed) % p;
+        z = (z + coeff * ((entries + p - 1) % p)) % p;
+    }
+    co_return co_await this->resolve(msg_id + 1, co_await this->reduce_degree(msg_id + 1, utils::narrow_cast<share>(z)));
+}
+
+cppcoro::task<bool> mpc_service::check_ballots(uint16_t msg_id, std::span<share> ballots, unsigned candidates) {
+    std::vector<cppcoro::task<share>> z_tasks;
+    z_tasks.reserve(validation_repeats);
+    for (unsigned k = 0; k < validation_repeats; k++)
+        z_tasks.push_back(this->ballots_constraint(msg_id + 2 * k, ballots, candidates));
+    auto z = co_await cppcoro::when_all(std::move(z_tasks));
+    co_return std::all_of(z.begin(), z.end(), [](share value) { return value == 0; });
+}
+
+cppcoro::task<> mpc_service::find_invalid(uint16_t msg_id, std::span<share> ballots, unsigned candidates,
+                                          unsigned first, bool known_invalid, std::vector<unsigned> &invalid) {
+    if (!known_invalid && co_await this->check_ballots(msg_id, ballots, candidates))
+        co_return;
+    const unsigned count = ballots.size() / candidates;
+    if (count == 1) {
+        invalid.push_back(first);
+        co_return;
+    }
+
+    // bisect; when the left half passes, the right one must hold the bad ballot
+    const unsigned half = count / 2;
+    auto left = ballots.first(half * candidates), right = ballots.subspan(half * candidates);
+    const bool left_valid = co_await this->check_ballots(msg_id, left, candidates);
+    if (!left_valid)
+        co_await this->find_invalid(msg_id, left, candidates, first, true, invalid);
+    co_await this->find_invalid(msg_id, right, candidates, first + half, left_valid, invalid);
+}
+
+cppcoro::task<std::vector<unsigned>> mpc_service::validate_ballots(uint16_t msg_id, std::span<share> ballots, unsigned candidates) {
+    assert(candidates > 0 && ballots.size() % candidates == 0);
+    std::vector<unsigned> invalid;
+    if (!ballots.empty())
+        co_await this->find_invalid(msg_id, ballots, candidates, 0, false, invalid);
+    co_return invalid;
 }
\ No newline at end of file
@@ -8,31 +8,68 @@
 #include <cppcoro/net/socket.hpp>
 
 #include "utils.h"
+#include "frame_pool.h"
 
 class talliers_network;
+class preprocessing_store;
 
 class mpc_service {
 public:
     static constexpr unsigned D = 3;
     static constexpr unsigned t = 2;
+    // the packed polynomial must still be recoverable from D shares
+    static constexpr unsigned max_packing = D - t + 1;
+    // independent random combinations per ballot check, each lets a bad batch pass with probability <= constraints / p
+    static constexpr unsigned validation_repeats = 2;
 private:
     talliers_network &network;
+    const uint8_t session;
     const std::unique_ptr<utils::share[]> vandermond_mat_inv_row;
+    const std::unique_ptr<utils::share[]> unpack_mat;
     const unsigned short p_bits_size;
     const unsigned short block_size;
+    preprocessing_store *preprocessed = nullptr;
+    bool king_reveal = false;
 public:
-    explicit mpc_service(talliers_network &network);
+    // services of different sessions run independently over the same network
+    explicit mpc_service(talliers_network &network, uint8_t session = 0);
+
+    // take random bits and bit-decomposed randoms from offline material while it lasts
+    void use_preprocessed(preprocessing_store &store) {
+        preprocessed = &store;
+    }
+
+    // make resolve go through resolve_king, every tallier must agree on it
+    void use_king_reveal(bool enable) {
+        king_reveal = enable;
+    }
 
     cppcoro::task<utils::share> multiply(uint16_t msg_id, utils::share a, utils::share b);
+    // sum of a_i * b_i for the price of a single multiply
+    cppcoro::task<utils::share> dot_product(uint16_t msg_id, std::span<const utils::share> a, std::span<const utils::share> b);
     cppcoro::task<utils::share> resolve(uint16_t msg_id, utils::share share);
+    // O(D) frames instead of O(D^2): the shares go to the round's king only, which sends back the value
+    cppcoro::task<utils::share> resolve_king(uint16_t msg_id, utils::share share);
     cppcoro::task<utils::share> random_number(uint16_t msg_id);
     cppcoro::task<utils::share> random_bit(uint16_t msg_id);
+    cppcoro::task<std::unique_ptr<utils::share[]>> random_bits(uint16_t msg_id, unsigned count);
     cppcoro::task<utils::share> fan_in_or(uint16_t msg_id, std::span<utils::share> bits);
     cppcoro::task<std::unique_ptr<utils::share[]>> prefix_or(uint16_t msg_id, std::span<utils::share> a_i);
     cppcoro::task<utils::share> less_bitwise(uint16_t msg_id, std::span<utils::share> a_i, std::span<utils::share> b_i);
     cppcoro::task<std::unique_ptr<utils::share[]>> random_number_bits(uint16_t msg_id);
     cppcoro::task<utils::share> is_odd(uint16_t msg_id, utils::share x);
     cppcoro::task<utils::share> less(uint16_t msg_id, utils::share a, utils::share b);
+
+    cppcoro::task<utils::share_vector> unpack(uint16_t msg_id, utils::share packed, unsigned count);
+
+    // ballots holds `candidates` shares per ballot; returns the indexes of ballots that aren't a single 1 among 0s
+    cppcoro::task<std::vector<unsigned>> validate_ballots(uint16_t msg_id, std::span<utils::share> ballots, unsigned candidates);
+private:
+    cppcoro::task<utils::share> reduce_degree(uint16_t msg_id, utils::share product);
+    cppcoro::task<utils::share> ballots_constraint(uint16_t msg_id, std::span<utils::share> ballots, unsigned candidates);
+    cppcoro::task<bool> check_ballots(uint16_t msg_id, std::span<utils::share> ballots, unsigned candidates);
+    cppcoro::task<> find_invalid(uint16_t msg_id, std::span<utils::share> ballots, unsigned candidates,
+                                 unsigned first, bool known_invalid, std::vector<unsigned> &invalid);
 };
 
 
@@ -0,0 +1,196 @@
+#include "preprocessing_store.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <system_error>
+#include <stdexcept>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cppcoro/when_all.hpp>
+
+#include "mpc_service.h"
+#include "talliers_network.h"
+
+static constexpr char file_magic[8] = {'V', 'S', 'P', 'R', 'E', 'P', '\0', '\0'};
+static constexpr uint32_t file_version = 2;
+// items reserved in the file at once, so the header is synced once every that many takes
+static constexpr size_t reserve_ahead = 4096;
+
+static uint64_t fnv1a(const void *data, size_t size, uint64_t hash = 0xcbf29ce484222325ULL) {
+    auto bytes = static_cast<const unsigned char *>(data);
+    for (size_t i = 0; i < size; i++)
+        hash = (hash ^ bytes[i]) * 0x100000001b3ULL;
+    return hash;
+}
+
+preprocessing_store::preprocessing_store(const char *path, unsigned tallier_id, bool verify_payload) {
+    int fd = ::open(path, O_RDWR | O_CLOEXEC);
+    if (fd < 0)
+        throw std::system_error(errno, std::generic_category(), "open preprocessing file");
+    struct stat st{};
+    if (::fstat(fd, &st) < 0) {
+        int err = errno;
+        ::close(fd);
+        throw std::system_error(err, std::generic_category(), "stat preprocessing file");
+    }
+    m_size = static_cast<size_t>(st.st_size);
+    if (m_size < sizeof(header)) {
+        ::close(fd);
+        throw std::runtime_error("preprocessing file too short");
+    }
+    m_mapping = ::mmap(nullptr, m_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (m_mapping == MAP_FAILED)
+        throw std::system_error(errno, std::generic_category(), "mmap preprocessing file");
+    ::madvise(m_mapping, m_size, MADV_SEQUENTIAL);
+
+    m_header = static_cast<header *>(m_mapping);
+    m_bits = reinterpret_cast<const utils::share *>(m_header + 1);
+    m_numbers = m_bits + m_header->bits_count;
+
+    const char *error = nullptr;
+    if (std::memcmp(m_header->magic, file_magic, sizeof(file_magic)) != 0 || m_header->version != file_version)
+        error = "not a preprocessing file";
+    else if (m_header->tallier_id != tallier_id)
+        error = "preprocessing file belongs to another tallier";
+    else if (m_header->talliers != mpc_service::D || m_header->threshold != mpc_service::t || m_header->prime != utils::p ||
+             m_header->bits_per_number != utils::ceil_log2(utils::p))
+        error = "preprocessing file made for other protocol parameters";
+    else if (m_size != sizeof(header) + (m_header->bits_count + m_header->numbers_count * m_header->bits_per_number) * sizeof(utils::share))
+        error = "preprocessing file truncated";
+    else if (m_header->bits_reserved > m_header->bits_count || m_header->numbers_reserved > m_header->numbers_count)
+        error = "preprocessing file has a bad consumption record";
+    else if (verify_payload && fnv1a(m_header + 1, m_size - sizeof(header)) != m_header->checksum)
+        error = "preprocessing file corrupted";
+    if (error) {
+        ::munmap(m_mapping, m_size);
+        throw std::runtime_error(error);
+    }
+    // reusing a random bit or mask of an earlier run would leak the values it hid
+    m_next_bit = m_header->bits_reserved;
+    m_next_number = m_header->numbers_reserved;
+}
+
+preprocessing_store::~preprocessing_store() {
+    ::munmap(m_mapping, m_size);
+}
+
+void preprocessing_store::reserve(uint64_t &reserved, size_t next, size_t count, size_t total) {
+    if (next + count <= reserved)
+        return;
+    reserved = std::min(next + count + reserve_ahead, total);
+    // must reach the disk before the items are used, or a crash could hand them out again
+    if (::msync(m_mapping, sizeof(header), MS_SYNC) < 0)
+        throw std::system_error(errno, std::generic_category(), "msync preprocessing file");
+}
+
+void preprocessing_store::resume_at(size_t bits, size_t numbers) {
+    m_next_bit = std::min<size_t>(std::max(bits, m_next_bit), m_header->bits_count);
+    m_next_number = std::min<size_t>(std::max(numbers, m_next_number), m_header->numbers_count);
+    reserve(m_header->bits_reserved, m_next_bit, 0, m_header->bits_count);
+    reserve(m_header->numbers_reserved, m_next_number, 0, m_header->numbers_count);
+}
+
+std::span<const utils::share> preprocessing_store::take_bits(size_t count) {
+    count = std::min(count, bits_left());
+    reserve(m_header->bits_reserved, m_next_bit, count, m_header->bits_count);
+    std::span<const utils::share> res{m_bits + m_next_bit, count};
+    m_next_bit += count;
+    return res;
+}
+
+std::span<const utils::share> preprocessing_store::take_number_bits() {
+    if (numbers_left() == 0)
+        return {};
+    const size_t width = m_header->bits_per_number;
+    reserve(m_header->numbers_reserved, m_next_number, 1, m_header->numbers_count);
+    std::span<const utils::share> res{m_numbers + m_next_number * width, width};
+    m_next_number++;
+    return res;
+}
+
+void preprocessing_store::write(const char *path, unsigned tallier_id,
+                                std::span<const utils::share> bits, std::span<const utils::share> numbers_bits) {
+    const uint32_t width = utils::ceil_log2(utils::p);
+    header head{};
+    std::memcpy(head.magic, file_magic, sizeof(file_magic));
+    head.version = file_version;
+    head.tallier_id = tallier_id;
+    head.talliers = mpc_service::D;
+    head.threshold = mpc_service::t;
+    head.prime = utils::p;
+    head.bits_per_number = width;
+    head.bits_count = bits.size();
+    head.numbers_count = numbers_bits.size() / width;
+    head.checksum = fnv1a(numbers_bits.data(), numbers_bits.size_bytes(), fnv1a(bits.data(), bits.size_bytes()));
+
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    out.write(reinterpret_cast<const char *>(&head), sizeof(head));
+    out.write(reinterpret_cast<const char *>(bits.data()), static_cast<std::streamsize>(bits.size_bytes()));
+    out.write(reinterpret_cast<const char *>(numbers_bits.data()), static_cast<std::streamsize>(numbers_bits.size_bytes()));
+    if (!out.flush())
+        throw std::runtime_error("failed writing preprocessing file");
+}
+
+cppcoro::task<> align_preprocessed(talliers_network &net, preprocessing_store &store) {
+    constexpr unsigned D = mpc_service::D;
+    // each offset travels as its low and high 32 bits, in the clear to every tallier
+    const uint64_t offsets[] = {store.bits_offset(), store.numbers_offset()};
+    std::vector<utils::share_vector> words;
+    words.reserve(4);
+    for (uint64_t offset : offsets) {
+        for (auto word : {static_cast<utils::share>(offset), static_cast<utils::share>(offset >> 32)}) {
+            utils::share_vector values(D);
+            std::fill(values.begin(), values.end(), word);
+            words.push_back(std::move(values));
+        }
+    }
+
+    std::vector<cppcoro::task<utils::share_vector>> tasks;
+    tasks.reserve(words.size());
+    for (unsigned i = 0; i < words.size(); i++)
+        tasks.push_back(net.exchange(0, static_cast<uint16_t>(i), words[i]));
+    auto answers = co_await cppcoro::when_all(std::move(tasks));
+
+    uint64_t furthest[2] = {0, 0};
+    for (unsigned o = 0; o < 2; o++)
+        for (unsigned i = 0; i < D; i++)
+            furthest[o] = std::max(furthest[o], answers[2 * o][i] | (uint64_t)answers[2 * o + 1][i] << 32);
+    store.resume_at(furthest[0], furthest[1]);
+}
+
+cppcoro::task<> preprocess(mpc_service &service, const char *path, unsigned tallier_id,
+                           size_t bits_count, size_t numbers_count) {
+    constexpr unsigned bits_chunk = 1024;
+    constexpr unsigned numbers_chunk = 16;
+    const unsigned width = utils::ceil_log2(utils::p);
+    const unsigned block = utils::block_size(utils::p);
+
+    std::vector<utils::share> bits;
+    bits.reserve(bits_count);
+    while (bits.size() < bits_count) {
+        const auto count = static_cast<unsigned>(std::min<size_t>(bits_chunk, bits_count - bits.size()));
+        auto chunk = co_await service.random_bits(0, count);
+        bits.insert(bits.end(), chunk.get(), chunk.get() + count);
+    }
+
+    std::vector<utils::share> numbers_bits;
+    numbers_bits.reserve(numbers_count * width);
+    for (size_t done = 0; done < numbers_count; done += numbers_chunk) {
+        const auto count = static_cast<unsigned>(std::min<size_t>(numbers_chunk, numbers_count - done));
+        std::vector<cppcoro::task<std::unique_ptr<utils::share[]>>> tasks;
+        tasks.reserve(count);
+        for (unsigned i = 0; i < count; i++)
+            tasks.push_back(service.random_number_bits(i * block));
+        for (auto &number : co_await cppcoro::when_all(std::move(tasks)))
+            numbers_bits.insert(numbers_bits.end(), number.get(), number.get() + width);
+    }
+
+    preprocessing_store::write(path, tallier_id, bits, numbers_bits);
+}
@@ -0,0 +1,88 @@
+#ifndef VOTE_SECURE_PREPROCESSING_STORE_H
+#define VOTE_SECURE_PREPROCESSING_STORE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <span>
+
+#include <cppcoro/task.hpp>
+
+#include "utils.h"
+
+class mpc_service;
+class talliers_network;
+
+// Offline material of a single tallier, memory mapped from a file written by preprocess().
+// Items are handed out in file order, so every tallier has to take them in the same order
+// (mpc_service takes them when a primitive starts, before its first exchange).
+// Consumption is recorded in the file ahead of use, so no item is handed out twice across runs.
+class preprocessing_store {
+public:
+    struct header {
+        char magic[8];
+        uint32_t version;
+        uint32_t tallier_id;
+        uint32_t talliers;
+        uint32_t threshold;
+        uint32_t prime;
+        uint32_t bits_per_number;
+        uint64_t bits_count;
+        uint64_t numbers_count;
+        uint64_t checksum;          // FNV-1a of everything after the header
+        // items before these may already have been used, a later run resumes after them
+        uint64_t bits_reserved;
+        uint64_t numbers_reserved;
+    };
+
+    preprocessing_store(const char *path, unsigned tallier_id, bool verify_payload = true);
+    ~preprocessing_store();
+    preprocessing_store(const preprocessing_store &) = delete;
+    preprocessing_store &operator=(const preprocessing_store &) = delete;
+
+    [[nodiscard]] size_t bits_left() const noexcept {
+        return m_header->bits_count - m_next_bit;
+    }
+    [[nodiscard]] size_t numbers_left() const noexcept {
+        return m_header->numbers_count - m_next_number;
+    }
+    [[nodiscard]] size_t bits_offset() const noexcept {
+        return m_next_bit;
+    }
+    [[nodiscard]] size_t numbers_offset() const noexcept {
+        return m_next_number;
+    }
+
+    // skip ahead to offsets the other talliers resume at, never going back
+    void resume_at(size_t bits, size_t numbers);
+
+    // shares of random bits, valid as long as the store lives
+    std::span<const utils::share> take_bits(size_t count);
+    // bits of a random number below p, least significant first
+    std::span<const utils::share> take_number_bits();
+
+    static void write(const char *path, unsigned tallier_id,
+                      std::span<const utils::share> bits, std::span<const utils::share> numbers_bits);
+private:
+    // records in the file that items up to next + count may be used
+    void reserve(uint64_t &reserved, size_t next, size_t count, size_t total);
+
+    void *m_mapping;
+    size_t m_size;
+    header *m_header;
+    const utils::share *m_bits;
+    const utils::share *m_numbers;
+    size_t m_next_bit = 0;
+    size_t m_next_number = 0;
+};
+
+// Every tallier resumes at the furthest offsets any of them recorded, so a run that stopped with
+// the talliers' reservations apart doesn't combine shares of different items. Must run on every
+// tallier before anything is taken.
+cppcoro::task<> align_preprocessed(talliers_network &net, preprocessing_store &store);
+
+// Runs the live protocols to produce bits_count random bits and numbers_count bit-decomposed
+// random numbers, and stores this tallier's shares of them in path.
+cppcoro::task<> preprocess(mpc_service &service, const char *path, unsigned tallier_id,
+                           size_t bits_count, size_t numbers_count);
+
+#endif //VOTE_SECURE_PREPROCESSING_STORE_H
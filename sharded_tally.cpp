@@ -0,0 +1,130 @@
+#include "sharded_tally.h"
+
+#include <iostream>
+#include <algorithm>
+
+#include <cppcoro/when_all.hpp>
+
+#include "talliers_network.h"
+#include "mpc_service.h"
+
+using utils::p;
+using utils::share;
+
+std::vector<share> partial_tally(std::span<const share> ballots, unsigned candidates) {
+    std::vector<uint64_t> sums(candidates, 0);
+    for (size_t i = 0; i < ballots.size(); i++)
+        sums[i % candidates] += ballots[i];
+    std::vector<share> res(candidates);
+    for (unsigned c = 0; c < candidates; c++)
+        res[c] = utils::narrow_cast<share>(sums[c] % p);
+    return res;
+}
+
+cppcoro::task<> submit_partial_tally(talliers_network &net, std::span<const share> tally) {
+    constexpr unsigned D = mpc_service::D;
+    // values[j] holds what aggregator j gets: its share of each candidate's re-sharing
+    std::vector<std::vector<share>> values(D, std::vector<share>(tally.size()));
+    for (unsigned c = 0; c < tally.size(); c++) {
+        auto sharing = utils::gen_shamir(tally[c], D, mpc_service::t);
+        for (unsigned j = 0; j < D; j++)
+            values[j][c] = sharing[j];
+    }
+
+    std::vector<cppcoro::task<>> tasks;
+    tasks.reserve(D);
+    for (unsigned j = 0; j < D; j++)
+        tasks.push_back(net.send_partial(0, static_cast<int8_t>(j), values[j]));
+    co_await cppcoro::when_all(std::move(tasks));
+}
+
+cppcoro::task<std::vector<share>> aggregate_tallies(talliers_network &net, unsigned committees, unsigned candidates) {
+    constexpr unsigned D = mpc_service::D;
+    auto partials = co_await net.collect_partials(committees, candidates);
+
+    // each shard member's re-sharing is weighted as in a degree reduction, then all shards are summed
+    const auto lambda = utils::vandermond_mat_inv_row(D);
+    std::vector<share> total(candidates);
+    for (unsigned c = 0; c < candidates; c++) {
+        uint64_t sum = 0;
+        for (unsigned k = 0; k < committees; k++)
+            for (unsigned i = 0; i < D; i++)
+                sum += ((uint64_t)partials[(k * D + i) * candidates + c] * lambda[i]) % p;
+        total[c] = utils::narrow_cast<share>(sum % p);
+    }
+    co_return total;
+}
+
+// Stands in for the voters: every tallier deals the ballots of its own voters, packed max_packing
+// candidates to a share, so each exchange brings one ballot part from every tallier. Returns
+// `parts` packed shares per ballot, ballots rounded up to a multiple of D.
+static cppcoro::task<std::vector<share>> deal_packed_ballots(talliers_network &net, unsigned ballots,
+                                                             unsigned candidates, unsigned parts) {
+    constexpr unsigned D = mpc_service::D;
+    constexpr unsigned packing = mpc_service::max_packing;
+    // part i of a round goes on msg_id i, in chunks that keep the ids apart
+    constexpr unsigned msg_chunk = 1024;
+    const unsigned rounds = (ballots + D - 1) / D;
+    std::vector<share> packed(rounds * D * parts);
+    std::vector<share> ballot(parts * packing);
+
+    for (unsigned first = 0; first < rounds * parts; first += msg_chunk) {
+        const auto count = std::min(msg_chunk, rounds * parts - first);
+        std::vector<utils::share_vector> sharings;
+        sharings.reserve(count);
+        for (unsigned slot = first; slot < first + count; slot++) {
+            const unsigned part = slot % parts;
+            if (part == 0) {
+                std::fill(ballot.begin(), ballot.end(), 0);
+                ballot[utils::random_value() % candidates] = 1;
+            }
+            sharings.push_back(utils::gen_packed_shamir({&ballot[part * packing], packing}, D, mpc_service::t));
+        }
+
+        std::vector<cppcoro::task<utils::share_vector>> tasks;
+        tasks.reserve(count);
+        for (unsigned i = 0; i < count; i++)
+            tasks.push_back(net.exchange(0, static_cast<uint16_t>(i), sharings[i]));
+        auto dealt = co_await cppcoro::when_all(std::move(tasks));
+        for (unsigned i = 0; i < count; i++) {
+            const unsigned round = (first + i) / parts, part = (first + i) % parts;
+            for (unsigned dealer = 0; dealer < D; dealer++)
+                packed[((round * D + dealer) * parts) + part] = dealt[i][dealer];
+        }
+    }
+    co_return packed;
+}
+
+cppcoro::task<> run_sharded_tally(talliers_network &net, mpc_service &service, uint8_t committee,
+                                  unsigned committees, unsigned ballots) {
+    constexpr unsigned candidates = 4;
+    constexpr unsigned packing = mpc_service::max_packing;
+    constexpr unsigned parts = (candidates + packing - 1) / packing;
+    if (committee != 0) {
+        // packed shares add up like plain ones, so the tally is summed packed and unpacked once
+        auto packed = co_await deal_packed_ballots(net, ballots, candidates, parts);
+        auto packed_tally = partial_tally(packed, parts);
+
+        std::vector<cppcoro::task<utils::share_vector>> tasks;
+        tasks.reserve(parts);
+        for (unsigned part = 0; part < parts; part++)
+            tasks.push_back(service.unpack(part, packed_tally[part], std::min(packing, candidates - part * packing)));
+        std::vector<share> tally;
+        tally.reserve(candidates);
+        for (auto &values : co_await cppcoro::when_all(std::move(tasks)))
+            tally.insert(tally.end(), values.begin(), values.end());
+
+        co_await submit_partial_tally(net, tally);
+        std::cout << "committee " << (int)committee << " submitted its partial tally" << std::endl;
+        co_return;
+    }
+
+    // the tallies stay shared, only the outcome of each comparison is opened
+    auto total = co_await aggregate_tallies(net, committees, candidates);
+    unsigned best = 0;
+    for (unsigned c = 1; c < candidates; c++) {
+        if (co_await service.resolve(0, co_await service.less(0, total[best], total[c])) == 1)
+            best = c;
+    }
+    std::cout << "winner " << best << std::endl;
+}
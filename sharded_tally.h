@@ -0,0 +1,31 @@
+#ifndef VOTE_SECURE_SHARDED_TALLY_H
+#define VOTE_SECURE_SHARDED_TALLY_H
+
+#include <span>
+#include <vector>
+
+#include <cppcoro/task.hpp>
+
+#include "utils.h"
+
+class talliers_network;
+class mpc_service;
+
+// Sharded deployment: ballots are split between shard committees 1..committees. Each one sums
+// its packed ballots into a packed partial tally, unpacks it and re-shares it to the aggregation
+// committee 0, which ends up with shares of the full tally and runs the comparisons.
+
+// per column sum of ballots holding `candidates` shares each, plain or packed alike, no interaction needed
+std::vector<utils::share> partial_tally(std::span<const utils::share> ballots, unsigned candidates);
+
+// shard committee side: re-share this tallier's shares of the partial tally to every aggregator
+cppcoro::task<> submit_partial_tally(talliers_network &net, std::span<const utils::share> tally);
+
+// aggregation committee side: this tallier's shares of the full tally
+cppcoro::task<std::vector<utils::share>> aggregate_tallies(talliers_network &net, unsigned committees, unsigned candidates);
+
+// local demo of the whole flow, with random ballots, run by every tallier of every committee
+cppcoro::task<> run_sharded_tally(talliers_network &net, mpc_service &service, uint8_t committee,
+                                  unsigned committees, unsigned ballots);
+
+#endif //VOTE_SECURE_SHARDED_TALLY_H
@@ -12,13 +12,67 @@
 #include <linux/tcp.h>
 
 struct [[gnu::packed]] msg_format {
+    uint8_t session;    // the channel sits in the bits above session_bits
     uint16_t msg_id;
     utils::share share;
 };
-static_assert(sizeof(msg_format) == 6);
+static_assert(sizeof(msg_format) == 7);
 
-static constexpr int port(int diff) {
-    return 5010 + diff;
+static constexpr unsigned session_bits = 6;
+static constexpr uint8_t session_mask = (1U << session_bits) - 1U;
+static_assert(talliers_network::max_sessions <= (1U << session_bits));
+
+static constexpr uint8_t session_byte(uint8_t session, unsigned kind) {
+    return static_cast<uint8_t>(session | kind << session_bits);
+}
+
+// king replies that were ready together: a header and count entries, each a msg_format without the session
+struct [[gnu::packed]] batch_header {
+    uint8_t session;
+    uint8_t count;
+};
+struct [[gnu::packed]] batch_entry {
+    uint16_t msg_id;
+    utils::share share;
+};
+static_assert(sizeof(batch_header) == 2 && sizeof(batch_entry) == 6);
+static constexpr size_t max_batch_entries = 32;
+
+struct [[gnu::packed]] partial_header {
+    uint8_t committee;
+    uint8_t member;
+    uint16_t count;
+};
+static_assert(sizeof(partial_header) == 4);
+
+static constexpr int8_t partial_sender_id = -3;
+
+static cppcoro::task<> send_all(cppcoro::net::socket &sock, const unsigned char *buffer, size_t size) {
+    while (size > 0) {
+        auto sent = co_await sock.send(buffer, size);
+        buffer += sent;
+        size -= sent;
+    }
+}
+
+static cppcoro::task<bool> recv_all(cppcoro::net::socket &sock, unsigned char *buffer, size_t size) {
+    while (size > 0) {
+        auto got = co_await sock.recv(buffer, size);
+        if (got == 0)
+            co_return false;
+        buffer += got;
+        size -= got;
+    }
+    co_return true;
+}
+
+static constexpr int port(int committee, int diff) {
+    return 5010 + committee * 16 + diff;
+}
+
+// partial tallies are uploaded to a range of their own, a mesh listener would take them for a tallier
+static constexpr int partials_port(int committee, int diff) {
+    return port(committee, diff) + 1000;
 }
 
 static void set_socketopt(int sock) {
@@ -32,13 +86,18 @@ static void set_socketopt(int sock) {
 //        throw std::system_error({res, std::generic_category()}, "setsocketopt(TCP_NODELAY)");
 }
 
-talliers_network::talliers_network(cppcoro::io_service &ioSvc, int8_t tallier_id) :
+talliers_network::talliers_network(cppcoro::io_service &ioSvc, int8_t tallier_id, unsigned max_in_flight, uint8_t committee) :
         ioSvc(ioSvc),
         talliers(new std::optional<cppcoro::net::socket>[mpc_service::D]),
-        server_address(cppcoro::net::ipv4_address(), port(tallier_id)),
-        tallier_id(tallier_id) {
+        send_windows(new credit_window[mpc_service::D]),
+        m_link(ioSvc, mpc_service::D),
+        server_address(cppcoro::net::ipv4_address(), port(committee, tallier_id)),
+        tallier_id(tallier_id),
+        committee(committee),
+        m_send_queues(new send_queue[mpc_service::D]) {
     this->talliers_waiting = ((1U << mpc_service::D) - 1U) ^ (1U << tallier_id);
-    m_values_table = std::make_unique<values_table>();
+    for (unsigned i = 0; i < mpc_service::D; i++)
+        send_windows[i] = credit_window(max_in_flight, max_sessions);
 }
 
 static cppcoro::task<> stop_server(cppcoro::cancellation_source &canceller, cppcoro::single_consumer_event &end_vote) {
@@ -122,7 +181,7 @@ cppcoro::task<> talliers_network::connect(int8_t curr_id, cppcoro::cancellation_
         auto sock = socket::create_tcpv4(ioSvc);
         set_socketopt(sock.native_handle());
         sock.bind(this->server_address);
-        co_await sock.connect(ipv4_endpoint(ipv4_address::loopback(), port(curr_id)), ct);
+        co_await sock.connect(ipv4_endpoint(ipv4_address::loopback(), port(committee, curr_id)), ct);
 
         int8_t reply_id;
         co_await sock.send(&this->tallier_id, 1, ct);
@@ -152,20 +211,85 @@ cppcoro::task<> talliers_network::connect(int8_t curr_id, cppcoro::cancellation_
 
 cppcoro::task<> talliers_network::recv_loop(cppcoro::net::socket &sock, size_t index) {
     constexpr size_t bufferSize = 16384;
-    size_t bytesRead;
+    constexpr size_t batchSize = 32;
+    static_assert(batchSize >= max_batch_entries, "a batch frame is decoded as a whole");
+    size_t bytesRead, pending = 0;
     auto buffer = std::make_unique<unsigned char[]>(bufferSize);
-    msg_format msg = {0, 0};
+    msg_format batch[batchSize];
+    uint8_t kinds[batchSize];
     auto cancel_token = m_stop_recv.token();
     try {
         do {
-            bytesRead = co_await sock.recv(buffer.get(), bufferSize, cancel_token);
+            bytesRead = co_await sock.recv(buffer.get() + pending, bufferSize - pending, cancel_token);
 //            std::cout << '[' << index << "] recv " << bytesRead << std::endl;
-            for (size_t idx = 0; idx < bytesRead; idx += sizeof(msg_format)) {
-                std::memcpy(&msg, &buffer[idx], sizeof(msg_format));
-                msg.msg_id = endian_number<uint16_t>::convert(msg.msg_id);
-                msg.share = endian_number<utils::share>::convert(msg.share);
-                m_values_table->items[msg.msg_id].set(msg.share, index);
+            const size_t available = pending + bytesRead;
+            size_t idx = 0;
+            for (bool complete = true; complete;) {
+                // decode a batch and prefetch its table slots before setting any of them
+                size_t count = 0;
+                while (count < batchSize) {
+                    if (idx == available) {
+                        complete = false;
+                        break;
+                    }
+                    const uint8_t kind = buffer[idx] >> session_bits;
+                    if (kind == static_cast<uint8_t>(channel::king_batch)) {
+                        batch_header header;
+                        if (available - idx < sizeof(header)) {
+                            complete = false;
+                            break;
+                        }
+                        std::memcpy(&header, &buffer[idx], sizeof(header));
+                        if (header.count == 0 || header.count > max_batch_entries || (header.session & session_mask) >= max_sessions) {
+                            // the frame length can't be trusted, so neither can anything after it
+                            std::cerr << "recv_loop " << index << " bad batch " << (int)header.session << ":" << (int)header.count << std::endl;
+                            co_return;
+                        }
+                        const size_t size = sizeof(header) + header.count * sizeof(batch_entry);
+                        if (available - idx < size) {
+                            complete = false;
+                            break;
+                        }
+                        if (count + header.count > batchSize)
+                            break;
+                        for (size_t e = 0; e < header.count; e++, count++) {
+                            batch_entry entry;
+                            std::memcpy(&entry, &buffer[idx + sizeof(header) + e * sizeof(entry)], sizeof(entry));
+                            auto &msg = batch[count];
+                            msg.session = header.session & session_mask;
+                            msg.msg_id = endian_number<uint16_t>::convert(entry.msg_id);
+                            msg.share = endian_number<utils::share>::convert(entry.share);
+                            kinds[count] = static_cast<uint8_t>(channel::king);
+                            __builtin_prefetch(&item(msg.session, msg.msg_id, channel::king), 1);
+                        }
+                        idx += size;
+                        continue;
+                    }
+
+                    if (available - idx < sizeof(msg_format)) {
+                        complete = false;
+                        break;
+                    }
+                    auto &msg = batch[count];
+                    std::memcpy(&msg, &buffer[idx], sizeof(msg_format));
+                    idx += sizeof(msg_format);
+                    msg.msg_id = endian_number<uint16_t>::convert(msg.msg_id);
+                    msg.share = endian_number<utils::share>::convert(msg.share);
+                    kinds[count] = kind;
+                    msg.session &= session_mask;
+                    if (msg.session >= max_sessions || kind > static_cast<uint8_t>(channel::king)) {
+                        std::cerr << "recv_loop " << index << " bad frame " << (int)msg.session << ":" << (int)kind << std::endl;
+                        continue;
+                    }
+                    __builtin_prefetch(&item(msg.session, msg.msg_id, static_cast<channel>(kind)), 1);
+                    count++;
+                }
+                for (size_t i = 0; i < count; i++)
+                    item(batch[i].session, batch[i].msg_id, static_cast<channel>(kinds[i])).set(batch[i].share, index);
             }
+            // a frame split between two reads is completed by the next one
+            pending = available - idx;
+            std::memmove(buffer.get(), buffer.get() + idx, pending);
         } while (bytesRead > 0);
     } catch (const cppcoro::operation_cancelled &) {
         co_await sock.disconnect();
@@ -175,20 +299,235 @@ cppcoro::task<> talliers_network::recv_loop(cppcoro::net::socket &sock, size_t i
     }
 }
 
-cppcoro::task<std::unique_ptr<utils::share[]>> talliers_network::exchange(uint16_t msg_id, std::span<utils::share> shares) {
-    auto exchange_one = [](cppcoro::net::socket &sock, uint16_t msg_id, utils::share value) -> cppcoro::task<> {
-        msg_format msg{msg_id, endian_number<utils::share>::convert(value)};
-        co_await sock.send(&msg, sizeof (msg));
-    };
-    auto &item = m_values_table->items[msg_id];
+exchange_item &talliers_network::item(uint8_t session, uint16_t msg_id, channel kind) {
+    auto &table = m_values_tables[static_cast<unsigned>(kind)][session];
+    if (!table) {
+        table = std::make_unique<values_table>();
+        if (kind == channel::king) {
+            // outside its own rounds a tallier only hears the king's reply
+            for (unsigned i = 0; i < 256 * 256; i++)
+                if (!is_king(i))
+                    table->items[i].expect_from(1U << king(i));
+        }
+    }
+    return table->items[msg_id];
+}
+
+cppcoro::task<> talliers_network::send_share(size_t index, uint8_t session, channel kind, uint16_t msg_id, utils::share value) {
+    // the emulated link delay is spent before taking a credit, so frames on the emulated wire
+    // don't hold room in the window and the measurements show the link rather than the window
+    if (m_link.enabled())
+        co_await m_link.transmit(index, sizeof(msg_format));
+    // wait for room in the peer's window, so a burst of exchanges can't flood the io_service queue;
+    // sessions wait in their own queue and get the freed room in turn
+    auto credit = co_await send_windows[index].acquire(session);
+    msg_format msg{session_byte(session, static_cast<unsigned>(kind)), msg_id, endian_number<utils::share>::convert(value)};
+    co_await write(index, {reinterpret_cast<const unsigned char *>(&msg), sizeof(msg)});
+}
+
+cppcoro::task<> talliers_network::send_frame(size_t index, uint8_t session, std::span<const unsigned char> frame) {
+    if (m_link.enabled())
+        co_await m_link.transmit(index, frame.size());
+    auto credit = co_await send_windows[index].acquire(session);
+    co_await write(index, frame);
+}
+
+cppcoro::task<> talliers_network::write(size_t index, std::span<const unsigned char> bytes) {
+    auto &queue = m_send_queues[index];
+    if (!queue.next)
+        queue.next = std::make_shared<outgoing>();
+    auto out = queue.next;
+    out->bytes.insert(out->bytes.end(), bytes.begin(), bytes.end());
+    if (!queue.writing)
+        scope.spawn(write_loop(index));
+    co_await out->written;
+}
+
+cppcoro::task<> talliers_network::write_loop(size_t index) {
+    auto &queue = m_send_queues[index];
+    queue.writing = true;
+    while (queue.next) {
+        auto out = std::move(queue.next);
+        try {
+            co_await send_all(*this->talliers[index], out->bytes.data(), out->bytes.size());
+        } catch (const std::system_error &err) {
+            std::cerr << "write_loop(syserr) " << index << ":" << err.what() << std::endl;
+        }
+        out->written.set();
+    }
+    queue.writing = false;
+}
+
+cppcoro::task<utils::share_vector> talliers_network::exchange(uint8_t session, uint16_t msg_id, std::span<utils::share> shares,
+                                                              unsigned needed, uint32_t *received) {
+    assert(session < max_sessions);
+    auto &item = this->item(session, msg_id);
+    co_await item.drained();
+    item.expect(needed);
     item.set(shares[tallier_id], tallier_id);
     msg_id = endian_number<uint16_t>::convert(msg_id);
     std::vector<cppcoro::task<>> tasks;
     tasks.reserve(shares.size());
     for (int i = 0; i < shares.size(); i++)
         if (this->talliers[i])
-            tasks.push_back(exchange_one(*this->talliers[i], msg_id, shares[i]));
+            tasks.push_back(send_share(i, session, channel::exchange, msg_id, shares[i]));
     tasks.push_back(static_cast<cppcoro::task<>>(item));
     co_await cppcoro::when_all(std::move(tasks));
+    if (received)
+        *received = item.received();
+    co_return item.result();
+}
+
+cppcoro::task<utils::share_vector> talliers_network::to_king(uint8_t session, uint16_t msg_id, utils::share share,
+                                                             unsigned needed, uint32_t *received) {
+    assert(session < max_sessions);
+    auto &item = this->item(session, msg_id, channel::king);
+    // the king answers the next round only once a slow tallier's share of this one came in, so that
+    // tallier never has more than two replies queued on the item
+    co_await item.drained();
+    if (is_king(msg_id)) {
+        item.expect(needed);
+        item.set(share, tallier_id);
+        co_await item;
+    } else {
+        co_await cppcoro::when_all(send_share(king(msg_id), session, channel::king, endian_number<uint16_t>::convert(msg_id), share),
+                                   static_cast<cppcoro::task<>>(item));
+    }
+    if (received)
+        *received = item.received();
     co_return item.result();
 }
+
+cppcoro::task<> talliers_network::king_reply(uint8_t session, uint16_t msg_id, utils::share value) {
+    // replies that become ready before the io_service gets back to the flush go out with it
+    auto &pending = m_pending_replies[session];
+    if (!pending) {
+        pending = std::make_shared<pending_replies>();
+        scope.spawn(flush_replies(session));
+    }
+    auto replies = pending;
+    replies->values.emplace_back(msg_id, value);
+    co_await replies->sent;
+}
+
+cppcoro::task<> talliers_network::flush_replies(uint8_t session) {
+    co_await ioSvc.schedule();
+    auto replies = std::move(m_pending_replies[session]);
+    const auto &values = replies->values;
+
+    // encoded once, every peer gets the same bytes in a single send
+    std::vector<unsigned char> frame;
+    if (values.size() == 1) {
+        msg_format msg{session_byte(session, static_cast<unsigned>(channel::king)),
+                       endian_number<uint16_t>::convert(values[0].first),
+                       endian_number<utils::share>::convert(values[0].second)};
+        frame.resize(sizeof(msg));
+        std::memcpy(frame.data(), &msg, sizeof(msg));
+    } else {
+        frame.reserve(values.size() * sizeof(batch_entry) + (values.size() / max_batch_entries + 1) * sizeof(batch_header));
+        for (size_t first = 0; first < values.size(); first += max_batch_entries) {
+            const size_t count = std::min(values.size() - first, max_batch_entries);
+            const batch_header header{session_byte(session, static_cast<unsigned>(channel::king_batch)), static_cast<uint8_t>(count)};
+            const auto *header_bytes = reinterpret_cast<const unsigned char *>(&header);
+            frame.insert(frame.end(), header_bytes, header_bytes + sizeof(header));
+            for (size_t i = first; i < first + count; i++) {
+                const batch_entry entry{endian_number<uint16_t>::convert(values[i].first),
+                                        endian_number<utils::share>::convert(values[i].second)};
+                const auto *entry_bytes = reinterpret_cast<const unsigned char *>(&entry);
+                frame.insert(frame.end(), entry_bytes, entry_bytes + sizeof(entry));
+            }
+        }
+    }
+
+    try {
+        std::vector<cppcoro::task<>> tasks;
+        tasks.reserve(mpc_service::D);
+        for (unsigned i = 0; i < mpc_service::D; i++)
+            if (this->talliers[i])
+                tasks.push_back(send_frame(i, session, frame));
+        co_await cppcoro::when_all(std::move(tasks));
+    } catch (const std::system_error &err) {
+        std::cerr << "flush_replies(syserr) " << (int)session << ":" << err.what() << std::endl;
+    }
+    replies->sent.set();
+}
+
+cppcoro::task<> talliers_network::send_partial(uint8_t target_committee, int8_t target, std::span<utils::share> values) {
+    using namespace cppcoro::net;
+    std::vector<unsigned char> buffer(sizeof(partial_header) + values.size_bytes());
+    partial_header header{committee, static_cast<uint8_t>(tallier_id), endian_number<uint16_t>::convert(static_cast<uint16_t>(values.size()))};
+    std::memcpy(buffer.data(), &header, sizeof(header));
+    for (size_t i = 0; i < values.size(); i++) {
+        auto value = endian_number<utils::share>::convert(values[i]);
+        std::memcpy(&buffer[sizeof(header) + i * sizeof(value)], &value, sizeof(value));
+    }
+
+    // the target may not listen yet, keep trying
+    for (;;) {
+        auto sock = socket::create_tcpv4(ioSvc);
+        bool connected = true;
+        try {
+            co_await sock.connect(ipv4_endpoint(ipv4_address::loopback(), partials_port(target_committee, target)));
+        } catch (const std::system_error &) {
+            connected = false;
+        }
+        if (!connected) {
+            co_await ioSvc.schedule_after(std::chrono::milliseconds(100));
+            continue;
+        }
+
+        int8_t reply_id, id = partial_sender_id;
+        co_await cppcoro::when_all(send_all(sock, reinterpret_cast<unsigned char *>(&id), 1),
+                                   recv_all(sock, reinterpret_cast<unsigned char *>(&reply_id), 1));
+        co_await send_all(sock, buffer.data(), buffer.size());
+        co_await sock.disconnect();
+        std::cout << "sent partial to " << (int)target_committee << ":" << (int)reply_id << std::endl;
+        co_return;
+    }
+}
+
+cppcoro::task<std::vector<utils::share>> talliers_network::collect_partials(unsigned committees, unsigned count) {
+    constexpr unsigned D = mpc_service::D;
+    std::vector<utils::share> res(committees * D * count);
+    std::vector<bool> arrived(committees * D, false);
+    unsigned remaining = committees * D;
+
+    auto listeningSocket = cppcoro::net::socket::create_tcpv4(ioSvc);
+    set_socketopt(listeningSocket.native_handle());
+    listeningSocket.bind(cppcoro::net::ipv4_endpoint(cppcoro::net::ipv4_address(), partials_port(committee, tallier_id)));
+    listeningSocket.listen();
+
+    std::vector<unsigned char> buffer(count * sizeof(utils::share));
+    while (remaining > 0) {
+        auto sock = cppcoro::net::socket::create_tcpv4(ioSvc);
+        co_await listeningSocket.accept(sock);
+        try {
+            int8_t reply_id;
+            partial_header header{};
+            co_await cppcoro::when_all(send_all(sock, reinterpret_cast<unsigned char *>(&this->tallier_id), 1),
+                                       recv_all(sock, reinterpret_cast<unsigned char *>(&reply_id), 1));
+            if (reply_id != partial_sender_id || !co_await recv_all(sock, reinterpret_cast<unsigned char *>(&header), sizeof(header))) {
+                std::cerr << "collect_partials: unexpected connection " << (int)reply_id << std::endl;
+                continue;
+            }
+            const unsigned index = (header.committee - 1U) * D + header.member;
+            if (header.committee == 0 || header.committee > committees || header.member >= D ||
+                endian_number<uint16_t>::convert(header.count) != count || arrived[index]) {
+                std::cerr << "collect_partials: bad partial from " << (int)header.committee << ":" << (int)header.member << std::endl;
+                continue;
+            }
+            if (!co_await recv_all(sock, buffer.data(), buffer.size()))
+                continue;
+            for (unsigned i = 0; i < count; i++) {
+                utils::share value;
+                std::memcpy(&value, &buffer[i * sizeof(value)], sizeof(value));
+                res[index * count + i] = endian_number<utils::share>::convert(value);
+            }
+            arrived[index] = true;
+            remaining--;
+        } catch (const std::system_error &err) {
+            std::cerr << "collect_partials(syserr) :" << err.what() << std::endl;
+        }
+    }
+    co_return res;
+}
\ No newline at end of file
@@ -15,31 +15,92 @@
 
 #include <optional>
 #include <memory>
+#include <utility>
+#include <vector>
 
 #include "utils.h"
 #include "exchange_item.h"
+#include "frame_pool.h"
+#include "credit_window.h"
+#include "link_emulator.h"
 
 class talliers_network {
 public:
-    talliers_network(cppcoro::io_service &ioSvc, int8_t tallier_id);
+    // shares a tallier may have queued towards a single peer before exchange waits
+    static constexpr unsigned default_max_in_flight = 1024;
+    // independent computations (races) multiplexed over the same connections
+    static constexpr unsigned max_sessions = 64;
+
+    // committees of a sharded deployment listen on separate port ranges, 0 is the aggregating one
+    talliers_network(cppcoro::io_service &ioSvc, int8_t tallier_id, unsigned max_in_flight = default_max_in_flight,
+                     uint8_t committee = 0);
     cppcoro::task<> build_collect();
+    void emulate(const link_profile &profile) {
+        m_link.set_profile(profile);
+    }
+    void emulate(size_t index, const link_profile &profile) {
+        m_link.set_profile(index, profile);
+    }
+
     auto close() {
         m_stop_recv.request_cancellation();
         return scope.join();
     }
 
-    cppcoro::task<std::unique_ptr<utils::share[]>> exchange(uint16_t msg_id, std::span<utils::share> shares);
+    // completes once `needed` shares (own included) arrived, the ones that did are flagged in `received`
+    cppcoro::task<utils::share_vector> exchange(uint8_t session, uint16_t msg_id, std::span<utils::share> shares,
+                                                unsigned needed = mpc_service::D, uint32_t *received = nullptr);
+
+    // tallier that gathers the shares of a king reveal, rotates with msg_id to spread the load
+    static unsigned king(uint16_t msg_id) {
+        return msg_id % mpc_service::D;
+    }
+    [[nodiscard]] bool is_king(uint16_t msg_id) const {
+        return king(msg_id) == static_cast<unsigned>(tallier_id);
+    }
+    // sends share to the king only. The king gets the shares once `needed` arrived (flagged in `received`)
+    // and must answer with king_reply, any other tallier gets that reply at the king's index
+    cppcoro::task<utils::share_vector> to_king(uint8_t session, uint16_t msg_id, utils::share share,
+                                               unsigned needed = mpc_service::D, uint32_t *received = nullptr);
+    // replies of a session that are ready together go out in one frame per peer
+    cppcoro::task<> king_reply(uint8_t session, uint16_t msg_id, utils::share value);
+
+    // hands this tallier's values to member `target` of another committee
+    cppcoro::task<> send_partial(uint8_t target_committee, int8_t target, std::span<utils::share> values);
+    // waits for send_partial from every member of committees 1..committees, count values each,
+    // returned as [committee - 1][member][count]
+    cppcoro::task<std::vector<utils::share>> collect_partials(unsigned committees, unsigned count);
 private:
+    // frames of king reveals are kept apart, their items expect other senders than an exchange;
+    // the channel rides in the spare high bits of a frame's session byte
+    enum class channel : uint8_t {
+        exchange = 0,
+        king = 1,
+        king_batch = 2,     // several king replies in one frame, they land in the king table
+    };
+    static constexpr unsigned channels_count = 3;
+    static constexpr unsigned tables_count = 2;
+    static_assert(channels_count <= 4 && max_sessions <= 64, "channel and session share one byte");
+
     cppcoro::task<> server(cppcoro::cancellation_token ct);
     cppcoro::task<> handle_connection(cppcoro::net::socket sock);
     cppcoro::task<> connect(int8_t curr_id, cppcoro::cancellation_token ct);
     cppcoro::task<> recv_loop(cppcoro::net::socket &sock, size_t index);
+    cppcoro::task<> send_share(size_t index, uint8_t session, channel kind, uint16_t msg_id, utils::share value);
+    cppcoro::task<> send_frame(size_t index, uint8_t session, std::span<const unsigned char> frame);
+    cppcoro::task<> flush_replies(uint8_t session);
+    cppcoro::task<> write(size_t index, std::span<const unsigned char> bytes);
+    cppcoro::task<> write_loop(size_t index);
+    exchange_item &item(uint8_t session, uint16_t msg_id, channel kind = channel::exchange);
 
     cppcoro::io_service &ioSvc;
     cppcoro::async_scope scope;
     std::unique_ptr<std::optional<cppcoro::net::socket>[]> talliers;
+    std::unique_ptr<credit_window[]> send_windows;
+    link_emulator m_link;
     cppcoro::net::ipv4_endpoint server_address;
     int8_t tallier_id;
+    uint8_t committee;
     uint32_t talliers_waiting;
     cppcoro::async_manual_reset_event all_talliers;
     cppcoro::single_consumer_event end_vote;
@@ -48,7 +109,27 @@ private:
     struct values_table {
         exchange_item items[256 * 256];
     };
-    std::unique_ptr<values_table> m_values_table;
+    // allocated on the first message of a session, by either side
+    std::unique_ptr<values_table> m_values_tables[tables_count][max_sessions];
+
+    struct pending_replies {
+        std::vector<std::pair<uint16_t, utils::share>> values;
+        cppcoro::async_manual_reset_event sent;
+    };
+    // king replies waiting for the next flush of their session
+    std::shared_ptr<pending_replies> m_pending_replies[max_sessions];
+
+    struct outgoing {
+        std::vector<unsigned char> bytes;
+        cppcoro::async_manual_reset_event written;
+    };
+    // A single writer per peer drains these, so a partial write is never interleaved with another
+    // frame; frames queued while a write is in flight go out together in the next one.
+    struct send_queue {
+        std::shared_ptr<outgoing> next;
+        bool writing = false;
+    };
+    std::unique_ptr<send_queue[]> m_send_queues;
 };
 
 
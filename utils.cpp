@@ -1,6 +1,8 @@
 #include <random>
 #include <iostream>
 #include <cmath>
+#include <bit>
+#include <vector>
 
 #include "utils.h"
 
@@ -58,9 +60,37 @@ namespace utils {
         return narrow_cast<share>(x);
     }
 
+    void batch_mod_inverse(std::span<share> values) {
+        // Montgomery's trick: one inversion of the product, then peel every value off it
+        if (values.empty())
+            return;
+        std::vector<share> prefix(values.size());
+        uint64_t acc = 1;
+        for (unsigned i = 0; i < values.size(); i++) {
+            assert(values[i] != 0);
+            prefix[i] = narrow_cast<share>(acc);
+            acc = (acc * values[i]) % p;
+        }
+        uint64_t inv = mod_inverse(narrow_cast<share>(acc));
+        for (unsigned i = values.size(); i-- > 0;) {
+            const share value = values[i];
+            values[i] = narrow_cast<share>((inv * prefix[i]) % p);
+            inv = (inv * value) % p;
+        }
+    }
+
     share modular_sqrt(share a) {
-        if (p % 4 == 3)
-            return pow(a, (p + 1) / 4);
+        if (p % 4 == 3) {
+            const unsigned exponent = (p + 1) / 4;
+            if (std::has_single_bit(exponent)) {
+                // true for Mersenne primes: the root is a fixed chain of squarings
+                uint64_t res = a;
+                for (int i = std::countr_zero(exponent); i > 0; i--)
+                    res = (res * res) % p;
+                return narrow_cast<share>(res);
+            }
+            return pow(a, exponent);
+        }
         share s = p - 1, e = 0;
         for (; s % 2 == 0; e++)
             s /= 2;
@@ -146,15 +176,16 @@ namespace utils {
         return result;
     }
 
-    std::unique_ptr<share[]> gen_shamir(unsigned value, unsigned shares_count, unsigned threshold) {
+    share_vector gen_shamir(unsigned value, unsigned shares_count, unsigned threshold) {
+        assert(threshold <= max_shares);
         // generate the coefficients for the shamir function
-        std::unique_ptr<unsigned[]> coeffs(new unsigned[threshold]);
+        unsigned coeffs[max_shares];
         coeffs[0] = value;
         for (int i = 1; i < threshold; i++)
             coeffs[i] = random_value();
 
         // generate the shares to every participant
-        std::unique_ptr<share[]> shares(new share[shares_count]);
+        share_vector shares(shares_count);
         for (int i = 0; i < shares_count; i++) {
             uint64_t res = 0;
             uint32_t x = i + 1;
@@ -169,6 +200,17 @@ namespace utils {
         return shares;
     }
 
+    // value at x of the Lagrange basis polynomial of points[j] over all points
+    static share lagrange_basis(share x, std::span<const share> points, unsigned j) {
+        uint64_t numerator = 1, denominator = 1;
+        for (unsigned m = 0; m < points.size(); m++) {
+            if (m == j) continue;
+            numerator = (numerator * ((p + x - points[m]) % p)) % p;
+            denominator = (denominator * ((p + points[j] - points[m]) % p)) % p;
+        }
+        return narrow_cast<share>((numerator * mod_inverse(narrow_cast<share>(denominator))) % p);
+    }
+
     share resolve_shamir(std::span<share> shares) {
         uint64_t sum = 0;
         for (int i = 0; i < shares.size(); i++) {
@@ -187,6 +229,56 @@ namespace utils {
         return narrow_cast<share>(sum % p);
     }
 
+    share resolve_shamir(std::span<share> shares, uint32_t present) {
+        // interpolate at 0 over the shares flagged in present only
+        share points[max_shares], values[max_shares];
+        unsigned count = 0;
+        for (unsigned i = 0; i < shares.size(); i++) {
+            if (present & (1U << i)) {
+                points[count] = i + 1;
+                values[count++] = shares[i];
+            }
+        }
+
+        uint64_t sum = 0;
+        for (unsigned i = 0; i < count; i++)
+            sum += ((uint64_t)lagrange_basis(0, {points, count}, i) * values[i]) % p;
+        return narrow_cast<share>(sum % p);
+    }
+
+    share_vector gen_packed_shamir(std::span<const share> values, unsigned shares_count, unsigned threshold) {
+        // the polynomial passes through value i at x = -i and through threshold - 1 random points after them
+        const unsigned points_count = values.size() + threshold - 1;
+        assert(points_count <= max_shares);
+        share points[max_shares], ys[max_shares];
+        for (unsigned i = 0; i < points_count; i++) {
+            points[i] = (p - i) % p;
+            ys[i] = i < values.size() ? values[i] : random_value();
+        }
+
+        share_vector shares(shares_count);
+        for (unsigned i = 0; i < shares_count; i++) {
+            uint64_t res = 0;
+            for (unsigned j = 0; j < points_count; j++)
+                res += ((uint64_t)ys[j] * lagrange_basis(i + 1, {points, points_count}, j)) % p;
+            shares[i] = narrow_cast<share>(res % p);
+        }
+        return shares;
+    }
+
+    std::unique_ptr<share[]> packed_unpack_matrix(unsigned shares_count, unsigned count) {
+        // row i holds the coefficients that evaluate the packed polynomial at x = -i from the shares at 1..shares_count
+        std::unique_ptr<share[]> points(new share[shares_count]);
+        for (unsigned j = 0; j < shares_count; j++)
+            points[j] = j + 1;
+
+        std::unique_ptr<share[]> matrix(new share[count * shares_count]);
+        for (unsigned i = 0; i < count; i++)
+            for (unsigned j = 0; j < shares_count; j++)
+                matrix[i * shares_count + j] = lagrange_basis((p - i) % p, {points.get(), shares_count}, j);
+        return matrix;
+    }
+
     std::unique_ptr<share[]> lagrange_polynomial_fan(unsigned count) {
         std::unique_ptr<share[]> coeffs(new share[count + 1]);
         for (unsigned i = 0; i < count + 1; i++)
@@ -4,6 +4,7 @@
 #include <span>
 #include <memory>
 #include <cstdint>
+#include <cassert>
 
 namespace utils {
     template <class T, class U>
@@ -16,17 +17,47 @@ namespace utils {
     extern unsigned p;
     unsigned random_value();
 
+    // one value per tallier, stored inline so a round of shares never touches the heap
+    static constexpr unsigned max_shares = 13;
+    class share_vector {
+    public:
+        explicit share_vector(unsigned size = 0) noexcept : m_size(size) {
+            assert(size <= max_shares);
+        }
+        share_vector(const share_vector &) = delete;
+        share_vector &operator=(const share_vector &) = delete;
+        share_vector(share_vector &&) noexcept = default;
+        share_vector &operator=(share_vector &&) noexcept = default;
+
+        share &operator[](unsigned i) noexcept { return m_values[i]; }
+        const share &operator[](unsigned i) const noexcept { return m_values[i]; }
+        [[nodiscard]] unsigned size() const noexcept { return m_size; }
+        share *data() noexcept { return m_values; }
+        share *begin() noexcept { return m_values; }
+        share *end() noexcept { return m_values + m_size; }
+        operator std::span<share>() noexcept { return {m_values, m_size}; }
+    private:
+        unsigned m_size;
+        share m_values[max_shares];
+    };
+
 //    share pow(share base, unsigned exponent);
 //    share gcd(share a, share b);
     share mod_inverse(share value);
+    void batch_mod_inverse(std::span<share> values);
     share modular_sqrt(share a);
     unsigned short ceil_sqrt(unsigned short val);
     unsigned short ceil_log2(unsigned int val);
     unsigned short block_size(unsigned int val);
     std::unique_ptr<share[]> vandermond_mat_inv_row(int N);
 
-    std::unique_ptr<share[]> gen_shamir(uint32_t value, unsigned shares_count, unsigned threshold);
+    share_vector gen_shamir(uint32_t value, unsigned shares_count, unsigned threshold);
     share resolve_shamir(std::span<share> shares);
+    share resolve_shamir(std::span<share> shares, uint32_t present);
+
+    // packed (Franklin-Yung) sharing: secret i is hidden at x = -i
+    share_vector gen_packed_shamir(std::span<const share> values, unsigned shares_count, unsigned threshold);
+    std::unique_ptr<share[]> packed_unpack_matrix(unsigned shares_count, unsigned count);
     std::unique_ptr<share[]> lagrange_polynomial_fan(unsigned count);
 };
 